@@ -0,0 +1,116 @@
+/* Benchmarks for the C++ interface, in the style of Google Benchmark.
+ *
+ * Usage: bench file...
+ *
+ * Converts the given documents over and over and reports the mean time per
+ * document, comparing a converter reused for all documents with a fresh one
+ * for every document, and conversions with and without a source map.
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "smu.hpp"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+std::vector<std::string> docs;
+std::size_t docbytes;
+volatile std::size_t sinkbytes;
+
+/* Runs pass until at least half a second has passed and prints the mean
+ * time per document. pass converts every document once. */
+template <class F>
+void
+run(const char *name, F pass) {
+	Clock::duration elapsed{};
+	unsigned long iterations = 0;
+
+	pass(); /* warm up */
+	while (elapsed < std::chrono::milliseconds(500)) {
+		auto start = Clock::now();
+		pass();
+		elapsed += Clock::now() - start;
+		iterations++;
+	}
+	double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+	std::printf("%-24s %12.0f ns %12lu %10.1f MB/s\n", name,
+	            ns / (iterations * docs.size()), iterations * docs.size(),
+	            iterations * docbytes / (ns / 1e9) / 1e6);
+}
+
+} /* namespace */
+
+int
+main(int argc, char *argv[]) {
+	for (int i = 1; i < argc; i++) {
+		std::ifstream f(argv[i], std::ios::binary);
+		std::stringstream s;
+
+		if (!f) {
+			std::fprintf(stderr, "Cannot open file `%s`\n", argv[i]);
+			return 1;
+		}
+		s << f.rdbuf();
+		docs.push_back(s.str());
+		docbytes += docs.back().size();
+	}
+	if (docs.empty()) {
+		std::fprintf(stderr, "Usage %s file...\n", argv[0]);
+		return 1;
+	}
+	std::printf("%zu documents, %zu bytes\n", docs.size(), docbytes);
+	std::printf("%-24s %15s %12s %15s\n", "Benchmark", "Time/doc", "Iterations", "Throughput");
+
+	run("fresh/string", [] {
+		for (const auto &d : docs) {
+			smu::Converter c;
+			std::string out;
+			c.convert(d, out);
+			sinkbytes = out.size();
+		}
+	});
+
+	smu::Converter reused;
+	std::string out;
+
+	run("reused/string", [&] {
+		for (const auto &d : docs) {
+			out.clear();
+			reused.convert(d, out);
+			sinkbytes = out.size();
+		}
+	});
+	run("reused/sink", [&] {
+		for (const auto &d : docs)
+			reused.convert(d, [](std::string_view html) { sinkbytes = html.size(); });
+	});
+	run("reused/batch", [&] {
+		out.clear();
+		reused.convert(docs.begin(), docs.end(), out);
+		sinkbytes = out.size();
+	});
+
+	SmuMap map{};
+	auto mapped = [&] {
+		for (const auto &d : docs) {
+			out.clear();
+			reused.convert(d, out);
+			sinkbytes = out.size() + map.len;
+		}
+	};
+	smu_setmap(&map);
+	run("reused/map-blocks", mapped);
+	map.inlines = 1;
+	run("reused/map-inline", mapped);
+	smu_setmap(nullptr);
+	std::free(map.data);
+	return 0;
+}
@@ -7,7 +7,7 @@ MANPREFIX = ${PREFIX}/share/man
 
 # includes and libs
 INCS = -I. -I/usr/include
-LIBS = -L/usr/lib
+LIBS = -L/usr/lib -lpthread
 
 # flags
 CFLAGS = -g -O0 -Wall -Werror -ansi ${INCS} -DVERSION=\"${VERSION}\" -Wstrict-prototypes
@@ -15,6 +15,9 @@ CFLAGS = -g -O0 -Wall -Werror -ansi ${INCS} -DVERSION=\"${VERSION}\" -Wstrict-pr
 #CFLAGS = -Os -Wall -Werror -ansi ${INCS} -DVERSION=\"${VERSION}\"
 #LDFLAGS = -fprofile-arcs -ftest-coverage -pg ${LIBS}
 LDFLAGS = ${LIBS}
+CXXFLAGS = -O2 -Wall -std=c++17 ${INCS}
+BENCHCFLAGS = -O2 -Wall -ansi ${INCS} -DVERSION=\"${VERSION}\"
 
 # compiler
 CC = cc
+CXX = c++
@@ -0,0 +1,701 @@
+/* smu - simple markup
+ * Copyright (C) <2007, 2008> Enno Boland <g s01 de>
+ *               2019-2022 Karl Bartel <karl@karl.berlin>
+ *               2022 bzt
+ *
+ * See LICENSE for further informations
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <sys/stat.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "smu.h"
+
+#define CHUNKSIZE  (1 << 20)
+#define NCHUNKS    4
+#define BATCHSIZE  (1 << 16)
+
+typedef struct {
+	char *path;
+	unsigned long hash, len, mtime;
+} Entry;  /* input file as recorded in the tree manifest */
+typedef struct {
+	dev_t dev;
+	ino_t ino;
+} Dir;    /* directory on the path walked in tree mode */
+typedef struct {
+	char *data;
+	unsigned long len, size;
+	int last;  /* marks the end of the stream */
+} Chunk;
+typedef struct {
+	Chunk *items[NCHUNKS];
+	unsigned long head, tail;  /* only written by consumer and producer */
+} Queue;   /* lock-free single producer, single consumer queue */
+
+static void backoff(unsigned int n);                                      /* Waits for a queue, increasingly long */
+static int convert(char *buffer, unsigned long len, const char *name);  /* Converts a whole document to stdout */
+static void convertbatch(const char *begin, const char *end);             /* Converts complete blocks in pipelined mode */
+static void convertfile(const char *rel, const struct stat *st);          /* Converts a file of the tree unless unchanged */
+static int entrycmp(const void *a, const void *b);
+static unsigned long hash(const char *begin, const char *end);           /* FNV-1a hash of the input */
+static char *mkpath(const char *dir, const char *name);
+static void pipeline(FILE *f);                                            /* Converts with reader and writer threads */
+static void printindex(FILE *f);                                          /* Prints the heading index for -x */
+static Chunk *qpop(Queue *q);
+static void qpush(Queue *q, Chunk *c);
+static void *reader(void *arg);                                           /* Thread filling input chunks */
+static char *readall(FILE *f, unsigned long *len);                       /* Reads a stream into a NUL terminated buffer */
+static void readmanifest(void);
+static char *readsection(FILE *f, unsigned long *len);                   /* Reads only the selected section */
+static void setlimit(const char *arg);                                    /* Parses a -l argument */
+static unsigned long splitpoint(const char *s, unsigned long start, unsigned long len); /* End of a batch of complete blocks */
+static void usage(void);
+static void walk(const char *rel, const struct stat *st);                 /* Converts a directory of the tree */
+static void *writer(void *arg);                                           /* Thread writing output chunks */
+
+static int nohtml = 0;
+static int utf8 = 0;
+static SmuLimits limits;
+static SmuMap map;
+static const char *mapfile;
+static int doindex = 0;
+static unsigned long section = 0;
+static const char *indexfile;
+static int pipelined = 0;
+
+/* pipelined mode */
+static Queue infull, inempty, outfull, outempty;
+static Chunk inchunks[NCHUNKS], outchunks[NCHUNKS];
+static char *scratch;
+static unsigned long scratchsize, consumed;
+static unsigned long scanned;  /* state of splitpoint */
+static int infence, incomment;
+
+/* tree mode */
+static const char *srcdir, *dstdir;
+static char manifesthead[64];
+static Entry *manifest;
+static unsigned long nmanifest, nconverted, nskipped, nfailed;
+static FILE *newmanifest;
+static Dir *dirs, outdir;   /* directories being walked, and the output */
+static unsigned long ndirs;
+
+int
+convert(char *buffer, unsigned long len, const char *name) {
+	unsigned long valid;
+	char *fixed;
+	int res;
+
+	if (utf8 && (valid = smu_utf8span(buffer, buffer + len)) != len) {
+		if (utf8 == 1) {
+			fprintf(stderr, "%s: Invalid UTF-8 at byte %lu\n", name, valid);
+			free(buffer);
+			return -1;
+		}
+		fprintf(stderr, "%s: Replacing invalid UTF-8 at byte %lu\n", name, valid);
+		fixed = smu_utf8fix(buffer, &len, valid);
+		free(buffer);
+		buffer = fixed;
+	}
+	if ((res = smu_convertstr(stdout, buffer, len, nohtml)))
+		fprintf(stderr, "%s: %s\n", name, smu_strerror(res));
+	free(buffer);
+	return res;
+}
+
+void
+backoff(unsigned int n) {
+	struct timespec ts = { 0, 100000 };
+
+	/* Yield first, but don't keep a CPU busy while waiting for I/O */
+	if (n < 64)
+		sched_yield();
+	else
+		nanosleep(&ts, NULL);
+}
+
+void
+convertbatch(const char *begin, const char *end) {
+	unsigned long len = end - begin, valid, written;
+	const char *in = begin;
+	char *fixed = NULL;
+	Chunk *c;
+	int res;
+
+	if (utf8 && (valid = smu_utf8span(begin, end)) != len) {
+		if (utf8 == 1)
+			eprint("Invalid UTF-8 at byte %lu\n", consumed + valid);
+		fprintf(stderr, "Replacing invalid UTF-8 at byte %lu\n", consumed + valid);
+		in = fixed = smu_utf8fix(begin, &len, valid);
+	}
+	c = qpop(&outempty);
+	if (scratchsize < 2 * (len + 2)) {
+		scratchsize = 2 * (len + 2);
+		scratch = ereallocz(scratch, scratchsize);
+	}
+	/* Grow the buffers and convert again when they were too small */
+	while ((res = smu_convertbuf(c->data, c->size, &written, in, len,
+	                             scratch, scratchsize, nohtml))) {
+		if (res == SMU_ESPACE) {
+			c->size = written;
+			c->data = ereallocz(c->data, c->size);
+		} else if (res == SMU_ESCRATCH) {
+			scratchsize *= 2;
+			scratch = ereallocz(scratch, scratchsize);
+		} else {
+			eprint("%s\n", smu_strerror(res));
+		}
+	}
+	c->len = written;
+	qpush(&outfull, c);
+	consumed += end - begin;
+	free(fixed);
+}
+
+void
+convertfile(const char *rel, const struct stat *st) {
+	char *buffer, *src, *dst, *p;
+	FILE *f;
+	Entry key, *e;
+	struct stat dst_st;
+
+	src = mkpath(srcdir, rel);
+	dst = ereallocz(NULL, strlen(dstdir) + strlen(rel) + 7);
+	sprintf(dst, "%s/%s", dstdir, rel);
+	p = strrchr(dst, '.');
+	strcpy(p, ".html");
+	key.path = (char *)rel;
+	key.len = st->st_size;
+	key.mtime = st->st_mtime;
+	e = bsearch(&key, manifest, nmanifest, sizeof(Entry), entrycmp);
+	if (e && stat(dst, &dst_st))
+		e = NULL;
+
+	/* Unchanged size and mtime are trusted, like make does, so that
+	 * unchanged files don't even have to be read. */
+	if (e && e->len == key.len && e->mtime == key.mtime) {
+		key.hash = e->hash;
+		nskipped++;
+	} else {
+		if (!(f = fopen(src, "r")))
+			eprint("Cannot open file `%s`\n", src);
+		buffer = readall(f, &key.len);
+		fclose(f);
+		key.hash = hash(buffer, buffer + key.len);
+		if (e && e->hash == key.hash && e->len == key.len) {
+			free(buffer);
+			nskipped++;
+		} else {
+			if (!freopen(dst, "w", stdout))
+				eprint("Cannot open file `%s`\n", dst);
+			if (convert(buffer, key.len, src)) {
+				/* Not recorded, so it is tried again next time */
+				nfailed++;
+				goto done;
+			}
+			nconverted++;
+		}
+	}
+	fprintf(newmanifest, "%08lx %lu %lu %s\n", key.hash, key.len, key.mtime, rel);
+done:
+	free(src);
+	free(dst);
+}
+
+int
+entrycmp(const void *a, const void *b) {
+	return strcmp(((const Entry *)a)->path, ((const Entry *)b)->path);
+}
+
+unsigned long
+hash(const char *begin, const char *end) {
+	unsigned long h = 2166136261UL;
+
+	for (; begin != end; begin++)
+		h = ((h ^ (unsigned char)*begin) * 16777619UL) & 0xffffffffUL;
+	return h;
+}
+
+char *
+mkpath(const char *dir, const char *name) {
+	char *path;
+
+	if (!*name)
+		name = ".";
+	path = ereallocz(NULL, strlen(dir) + strlen(name) + 2);
+	sprintf(path, "%s/%s", dir, name);
+	return path;
+}
+
+void
+pipeline(FILE *f) {
+	pthread_t rthread, wthread;
+	char *buffer = NULL;
+	unsigned long len = 0, size = 0, start, n;
+	int i, last, fd = fileno(f), out = STDOUT_FILENO;
+	Chunk *c;
+
+	for (i = 0; i < NCHUNKS; i++) {
+		inchunks[i].size = outchunks[i].size = CHUNKSIZE;
+		inchunks[i].data = ereallocz(NULL, CHUNKSIZE);
+		outchunks[i].data = ereallocz(NULL, CHUNKSIZE);
+		qpush(&inempty, &inchunks[i]);
+		qpush(&outempty, &outchunks[i]);
+	}
+	if (pthread_create(&rthread, NULL, reader, &fd)
+	|| pthread_create(&wthread, NULL, writer, &out))
+		eprint("Cannot create threads\n");
+
+	/* Collect input until it holds complete blocks, and convert them
+	 * while the next chunk is read */
+	do {
+		c = qpop(&infull);
+		if (len + c->len > size) {
+			size = 2 * size + c->len;
+			buffer = ereallocz(buffer, size);
+		}
+		memcpy(buffer + len, c->data, c->len);
+		len += c->len;
+		/* The reader refills the chunk once it is back in the queue */
+		if (!(last = c->last))
+			qpush(&inempty, c);
+		for (start = 0; (n = splitpoint(buffer, start, len)); start = n)
+			convertbatch(buffer + start, buffer + n);
+		if (last)
+			convertbatch(buffer + start, buffer + len);
+		memmove(buffer, buffer + start, len - start);
+		len -= start;
+		scanned -= start;
+	} while (!last);
+
+	c = qpop(&outempty);
+	c->last = 1;
+	qpush(&outfull, c);
+	pthread_join(rthread, NULL);
+	pthread_join(wthread, NULL);
+	for (i = 0; i < NCHUNKS; i++) {
+		free(inchunks[i].data);
+		free(outchunks[i].data);
+	}
+	free(buffer);
+	free(scratch);
+}
+
+void
+printindex(FILE *f) {
+	char *buffer;
+	unsigned long len, n, i;
+	SmuHeading *h;
+
+	buffer = readall(f, &len);
+	n = smu_index(buffer, len, NULL, 0);
+	h = ereallocz(NULL, n * sizeof(*h) + 1);
+	smu_index(buffer, len, h, n);
+	/* The input size is recorded to catch stale indexes */
+	printf("smu-index %lu\n", len);
+	for (i = 0; i < n; i++)
+		printf("%d %lu %lu %.*s\n", h[i].level, h[i].begin, h[i].end,
+		       (int)(h[i].titleend - h[i].title), buffer + h[i].title);
+	free(h);
+	free(buffer);
+}
+
+Chunk *
+qpop(Queue *q) {
+	Chunk *c;
+	unsigned int n;
+
+	for (n = 0; __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == q->head; n++)
+		backoff(n);
+	c = q->items[q->head % NCHUNKS];
+	__atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+	return c;
+}
+
+void
+qpush(Queue *q, Chunk *c) {
+	unsigned int n;
+
+	for (n = 0; q->tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == NCHUNKS; n++)
+		backoff(n);
+	q->items[q->tail % NCHUNKS] = c;
+	__atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+}
+
+void *
+reader(void *arg) {
+	int fd = *(int *)arg;
+	ssize_t s;
+	Chunk *c;
+
+	do {
+		c = qpop(&inempty);
+		/* Fill whole chunks to keep the handoffs few */
+		for (c->len = 0; c->len < c->size; c->len += s)
+			if ((s = read(fd, c->data + c->len, c->size - c->len)) <= 0)
+				break;
+		if (s < 0)
+			eprint("Cannot read input: %s\n", strerror(errno));
+		c->last = s == 0;
+		qpush(&infull, c);
+	} while (s);
+	return NULL;
+}
+
+char *
+readall(FILE *f, unsigned long *len) {
+	char *buffer = NULL;
+	unsigned long bsize = 0, s;
+
+	*len = 0;
+	do {
+		/* No need to read further than the input limit */
+		if (limits.input && *len > limits.input)
+			break;
+		if (*len + BUFSIZ + 1 > bsize) {
+			bsize = 2 * bsize + BUFSIZ + 1;
+			buffer = ereallocz(buffer, bsize);
+		}
+		*len += s = fread(buffer + *len, 1, BUFSIZ, f);
+	} while (s);
+	buffer[*len] = '\0';
+	return buffer;
+}
+
+void
+readmanifest(void) {
+	char *path, line[BUFSIZ], *p;
+	FILE *f;
+	Entry e;
+	unsigned long size = 0;
+
+	path = mkpath(dstdir, ".smu-manifest");
+	f = fopen(path, "r");
+	free(path);
+	if (!f)
+		return;
+	/* A manifest of a different converter version or different options
+	 * is ignored, so everything gets converted again */
+	if (fgets(line, sizeof(line), f) && !strcmp(line, manifesthead)) {
+		while (fgets(line, sizeof(line), f)) {
+			e.hash = strtoul(line, &p, 16);
+			e.len = strtoul(p, &p, 10);
+			e.mtime = strtoul(p, &p, 10);
+			if (*p++ != ' ' || !(e.path = strtok(p, "\n")))
+				continue;
+			e.path = strcpy(ereallocz(NULL, strlen(e.path) + 1), e.path);
+			if (nmanifest == size) {
+				size = 2 * size + 64;
+				manifest = ereallocz(manifest, size * sizeof(Entry));
+			}
+			manifest[nmanifest++] = e;
+		}
+		qsort(manifest, nmanifest, sizeof(Entry), entrycmp);
+	}
+	fclose(f);
+}
+
+char *
+readsection(FILE *f, unsigned long *len) {
+	char *buffer;
+	unsigned long i, n, size;
+	int c, level;
+	FILE *idx;
+	SmuHeading h, *all;
+	struct stat st;
+
+	if (!indexfile) {
+		buffer = readall(f, len);
+		n = smu_index(buffer, *len, NULL, 0);
+		if (section > n)
+			eprint("No section %lu, there are %lu\n", section, n);
+		all = ereallocz(NULL, n * sizeof(*all));
+		smu_index(buffer, *len, all, n);
+		h = all[section - 1];
+		free(all);
+		*len = h.end - h.begin;
+		memmove(buffer, buffer + h.begin, *len);
+		buffer[*len] = '\0';
+		return buffer;
+	}
+
+	/* With an index only the section itself has to be read */
+	if (!(idx = fopen(indexfile, "r")))
+		eprint("Cannot open file `%s`\n", indexfile);
+	if (fscanf(idx, "smu-index %lu", &size) != 1 || fstat(fileno(f), &st) || st.st_size != size)
+		eprint("Index `%s` does not match the input\n", indexfile);
+	for (i = 0; i < section && (c = getc(idx)) != EOF;)
+		if (c == '\n')
+			i++;
+	if (i < section || fscanf(idx, "%d %lu %lu", &level, &h.begin, &h.end) != 3
+	|| h.begin > h.end || h.end > size)
+		eprint("No section %lu in index `%s`\n", section, indexfile);
+	fclose(idx);
+	*len = h.end - h.begin;
+	buffer = ereallocz(NULL, *len + 1);
+	if (fseek(f, h.begin, SEEK_SET) || fread(buffer, 1, *len, f) != *len)
+		eprint("Cannot read section %lu\n", section);
+	buffer[*len] = '\0';
+	return buffer;
+}
+
+void
+setlimit(const char *arg) {
+	static const char *names[] = { "input", "output", "depth", "work" };
+	unsigned long *values[4];
+	unsigned int i, l;
+	char *end;
+
+	values[0] = &limits.input;
+	values[1] = &limits.output;
+	values[2] = &limits.depth;
+	values[3] = &limits.work;
+	for (i = 0; i < 4; i++) {
+		l = strlen(names[i]);
+		if (!strncmp(arg, names[i], l) && arg[l] == '=') {
+			*values[i] = strtoul(arg + l + 1, &end, 10);
+			if (end != arg + l + 1 && !*end)
+				return;
+		}
+	}
+	usage();
+}
+
+unsigned long
+splitpoint(const char *s, unsigned long start, unsigned long len) {
+	const char *p, *q;
+
+	/* A line after an empty line starts a new top level block, unless it
+	 * could continue a list, an indented block, a code fence, or html.
+	 * Returns the first such line at least BATCHSIZE bytes after start.
+	 * Keep some bytes back to look ahead. */
+	for (; scanned + 4 < len; scanned++) {
+		p = s + scanned;
+		if (incomment) {
+			if (!strncmp(p, "-->", 3))
+				incomment = 0;
+		} else if (infence) {
+			/* As in docodefence, a fence closes at any unescaped ``` */
+			if (!strncmp(p, "```", 3) && (!scanned || p[-1] != '\\')) {
+				infence = 0;
+				scanned += 2;
+			}
+		} else if (!strncmp(p, "```", 3) && (scanned <= 1 || p[-1] == '\n'
+		|| (scanned >= 3 && p[-2] == '\n' && p[-3] == '\n'))) {
+			/* but opens only at the start of a line, which also ends a
+			 * paragraph, or after the first character of a block, see
+			 * doparagraph. The rest of the line is the language. */
+			if (!(q = memchr(p, '\n', len - scanned)))
+				return 0;
+			infence = 1;
+			scanned = q - s;
+		} else if (!strncmp(p, "<!--", 4)) {
+			incomment = 1;
+		} else if (scanned >= 2 && p[-1] == '\n' && p[-2] == '\n'
+		&& !strchr(" \t\n-*+<", *p) && !isdigit((unsigned char)*p)
+		&& scanned - start >= BATCHSIZE) {
+			return scanned;
+		}
+	}
+	return 0;
+}
+
+void
+usage(void) {
+	eprint("Usage smu [-n] [-u|-U] [-p] [-l limit=n]... [-m|-M mapfile]\n"
+	       "           [-x | --section n [--index idxfile]]\n"
+	       "           [file | -r srcdir -o outdir]\n"
+	       " -n escape html strictly\n"
+	       " -u reject invalid UTF-8\n -U replace invalid UTF-8\n"
+	       " -p read, convert and write in parallel\n"
+	       " -l limit input, output, depth or work per document\n"
+	       " -m write a source map of the blocks, -M of all elements\n"
+	       " -x print an index of the headings\n"
+	       " --section convert only the nth heading and its subsections\n"
+	       " --index use an index printed by -x to find the section\n"
+	       " -r convert all .text and .md files below srcdir to outdir\n");
+}
+
+void
+walk(const char *rel, const struct stat *st) {
+	struct dirent **names;
+	struct stat sub;
+	char *path, *src, *ext;
+	unsigned long i;
+	int j, n;
+
+	dirs = ereallocz(dirs, (ndirs + 1) * sizeof(Dir));
+	dirs[ndirs].dev = st->st_dev;
+	dirs[ndirs++].ino = st->st_ino;
+	path = mkpath(srcdir, rel);
+	/* Sorted, so that files are converted in the same order every time */
+	if ((n = scandir(path, &names, NULL, alphasort)) < 0)
+		eprint("Cannot open directory `%s`\n", path);
+	free(path);
+	path = mkpath(dstdir, rel);
+	if (mkdir(path, 0777) && errno != EEXIST)
+		eprint("Cannot create directory `%s`\n", path);
+	free(path);
+	for (j = 0; j < n; free(names[j++])) {
+		if (names[j]->d_name[0] == '.')
+			continue;
+		path = *rel ? mkpath(rel, names[j]->d_name)
+		     : strcpy(ereallocz(NULL, strlen(names[j]->d_name) + 1), names[j]->d_name);
+		src = mkpath(srcdir, path);
+		if (stat(src, &sub))
+			eprint("Cannot stat `%s`\n", src);
+		ext = strrchr(path, '.');
+		if (S_ISDIR(sub.st_mode)) {
+			/* Skip the output below the source, and links back to a
+			 * directory that is being walked */
+			for (i = 0; i < ndirs && (dirs[i].dev != sub.st_dev || dirs[i].ino != sub.st_ino); i++);
+			if (i < ndirs)
+				fprintf(stderr, "Skipping `%s`, it links to a parent directory\n", src);
+			else if (sub.st_dev != outdir.dev || sub.st_ino != outdir.ino)
+				walk(path, &sub);
+		} else if (S_ISREG(sub.st_mode) && ext && (!strcmp(ext, ".text") || !strcmp(ext, ".md")))
+			convertfile(path, &sub);
+		free(src);
+		free(path);
+	}
+	free(names);
+	ndirs--;
+}
+
+void *
+writer(void *arg) {
+	int fd = *(int *)arg;
+	unsigned long n;
+	ssize_t s;
+	Chunk *c;
+
+	while (!(c = qpop(&outfull))->last) {
+		for (n = 0; n < c->len; n += s)
+			if ((s = write(fd, c->data + n, c->len - n)) < 0)
+				eprint("Cannot write output: %s\n", strerror(errno));
+		qpush(&outempty, c);
+	}
+	return NULL;
+}
+
+int
+main(int argc, char *argv[]) {
+	char *buffer, *path, *tmp;
+	int i, res;
+	unsigned long len;
+	FILE *source = stdin;
+	struct stat st;
+	struct timespec t0, t1;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp("-v", argv[i]))
+			eprint("simple markup %s (C) Enno Boland\n",VERSION);
+		else if (!strcmp("-n", argv[i]))
+			nohtml = 1;
+		else if (!strcmp("-u", argv[i]))
+			utf8 = 1;
+		else if (!strcmp("-U", argv[i]))
+			utf8 = 2;
+		else if (!strcmp("-l", argv[i]) && i + 1 < argc)
+			setlimit(argv[++i]);
+		else if ((!strcmp("-m", argv[i]) || !strcmp("-M", argv[i])) && i + 1 < argc) {
+			map.inlines = argv[i][1] == 'M';
+			mapfile = argv[++i];
+		}
+		else if (!strcmp("-p", argv[i]))
+			pipelined = 1;
+		else if (!strcmp("-x", argv[i]))
+			doindex = 1;
+		else if (!strcmp("--section", argv[i]) && i + 1 < argc) {
+			if (!(section = strtoul(argv[++i], NULL, 10)))
+				usage();
+		}
+		else if (!strcmp("--index", argv[i]) && i + 1 < argc)
+			indexfile = argv[++i];
+		else if (!strcmp("-r", argv[i]) && i + 1 < argc)
+			srcdir = argv[++i];
+		else if (!strcmp("-o", argv[i]) && i + 1 < argc)
+			dstdir = argv[++i];
+		else if (argv[i][0] != '-')
+			break;
+		else if (!strcmp("--", argv[i])) {
+			i++;
+			break;
+		}
+		else
+			break;
+	}
+	if ((i < argc && argv[i][0] == '-') || !srcdir != !dstdir || (srcdir && i < argc)
+	|| (srcdir && (doindex || section || mapfile)) || (indexfile && !section)
+	|| (pipelined && (srcdir || doindex || section || mapfile || limits.input
+	                  || limits.output || limits.depth || limits.work)))
+		usage();
+	smu_setlimits(&limits);
+
+	if (srcdir) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		sprintf(manifesthead, "smu %s %d %d\n", VERSION, nohtml, utf8);
+		if (mkdir(dstdir, 0777) && errno != EEXIST)
+			eprint("Cannot create directory `%s`\n", dstdir);
+		if (stat(dstdir, &st))
+			eprint("Cannot stat `%s`\n", dstdir);
+		outdir.dev = st.st_dev;
+		outdir.ino = st.st_ino;
+		if (stat(srcdir, &st))
+			eprint("Cannot stat `%s`\n", srcdir);
+		readmanifest();
+		path = mkpath(dstdir, ".smu-manifest");
+		tmp = mkpath(dstdir, ".smu-manifest.tmp");
+		if (!(newmanifest = fopen(tmp, "w")))
+			eprint("Cannot open file `%s`\n", tmp);
+		fputs(manifesthead, newmanifest);
+		walk("", &st);
+		free(dirs);
+		if (fclose(newmanifest) || rename(tmp, path))
+			eprint("Cannot write manifest `%s`\n", path);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		fprintf(stderr, "%lu converted, %lu skipped", nconverted, nskipped);
+		if (nfailed)
+			fprintf(stderr, ", %lu failed", nfailed);
+		fprintf(stderr, " in %.3fs\n", (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+		return nfailed ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if (i < argc && !(source = fopen(argv[i], "r")))
+		eprint("Cannot open file `%s`\n",argv[i]);
+	if (pipelined) {
+		pipeline(source);
+		fclose(source);
+		return EXIT_SUCCESS;
+	}
+	if (doindex) {
+		printindex(source);
+		fclose(source);
+		return EXIT_SUCCESS;
+	}
+	buffer = section ? readsection(source, &len) : readall(source, &len);
+	fclose(source);
+	if (mapfile)
+		smu_setmap(&map);
+	res = convert(buffer, len, i < argc ? argv[i] : "stdin");
+	if (mapfile) {
+		if (!(source = fopen(mapfile, "w")) || fwrite(map.data, 1, map.len, source) != map.len
+		|| fclose(source))
+			eprint("Cannot write source map `%s`\n", mapfile);
+		free(map.data);
+	}
+	/* Distinct exit status for each limit, after EXIT_FAILURE */
+	if (res)
+		return res < 0 ? EXIT_FAILURE : EXIT_FAILURE + res;
+	return EXIT_SUCCESS;
+}
@@ -6,14 +6,18 @@
  * See LICENSE for further informations
  */
 #include <ctype.h>
-#include <regex.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "smu.h"
 
 #define LENGTH(x)  sizeof(x)/sizeof(x[0])
-#define ADDC(b,i)  if (i % BUFSIZ == 0) { b = realloc(b, (i + BUFSIZ) * sizeof(char)); if (!b) eprint("Malloc failed."); } b[i]
+#define ADDC(b,i)  if (i < b##size) b[i]
 
 typedef int (*Parser)(const char *, const char *, int);
 typedef struct {
@@ -34,9 +38,22 @@ static int doreplace(const char *begin, const char *end, int newblock);   /* Par
 static int doshortlink(const char *begin, const char *end, int newblock); /* Parser for links and images */
 static int dosurround(const char *begin, const char *end, int newblock);  /* Parser for surrounding tags */
 static int dounderline(const char *begin, const char *end, int newblock); /* Parser for underline tags */
-static void *ereallocz(void *p, size_t size);
+static char *balloc(unsigned long size);                                  /* Allocates from scratch or heap */
+static void bfree(char *p);                                               /* Frees, must be in reverse order of balloc */
+static void charge(const char *begin, const char *end);                   /* Counts bytes examined against the work limit */
+static int convert(const char *begin, const char *end, int suppresshtml); /* Converts with the output set up */
+static const char *find(const char *s, const char *needle);               /* strstr counting the work */
+static const char *findany(const char *s, const char *accept);            /* strpbrk counting the work */
 static void hprint(const char *begin, const char *end);                   /* escapes HTML and prints it to output */
+static void mapadd(unsigned long o, unsigned long i);                     /* Adds an entry to the source map */
+static void oprintf(const char *format, ...);                             /* Output functions, */
+static void oputc(int c);                                                 /* checking the output limit */
+static void oputs(const char *s);
+static void owrite(const char *s, unsigned long len);
 static void process(const char *begin, const char *end, int isblock);     /* Processes range between begin and end. */
+#ifdef __SSE2__
+static unsigned int utf8block(const unsigned char *p);                    /* Validates 16 bytes of UTF-8 at once */
+#endif
 
 /* list of parsers */
 static Parser parsers[] = { dounderline, docomment, docodefence, dolineprefix,
@@ -44,8 +61,30 @@ static Parser parsers[] = { dounderline, docomment, docodefence, dolineprefix,
 	                    doshortlink, dohtml, doreplace };
 static int nohtml = 0;
 static int in_paragraph = 0;
-
-regex_t p_end_regex;  /* End of paragraph */
+static signed char intable, inrow, incell;  /* table state */
+static unsigned long calign;
+
+/* conversion state */
+static FILE *out;                     /* output stream, or NULL for */
+static char *outbuf;                  /* a buffer of outsize bytes */
+static unsigned long outsize;
+static char *scratch;                 /* arena for nested blocks, NULL for heap */
+static unsigned long scratchsize, scratchused;
+static SmuLimits limits;
+static SmuMap *map;
+static const char *docbegin, *docend;     /* input the source map refers to */
+static unsigned long outlen, work, depth;
+static int err;
+
+static const char *errors[] = {
+	"Success",                 /* SMU_OK */
+	"Input limit exceeded",    /* SMU_EINPUT */
+	"Output limit exceeded",   /* SMU_EOUTPUT */
+	"Nesting limit exceeded",  /* SMU_EDEPTH */
+	"Work limit exceeded",     /* SMU_EWORK */
+	"Output buffer too small", /* SMU_ESPACE */
+	"Scratch buffer too small",/* SMU_ESCRATCH */
+};
 
 static Tag lineprefix[] = {
 	{ "    ",       0,      "<pre><code>", "\n</code></pre>" },
@@ -125,6 +164,27 @@ static const char *replace[][2] = {
 
 static const char *code_fence = "```";
 
+/* Length of the UTF-8 sequence started by each byte, 0 if it can't start one.
+ * NUL is rejected as well, since the parsers treat it as end of input. */
+static const unsigned char utf8len[256] = {
+	0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, /* 0x00 */
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 0x80 */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, /* 0xC0 */
+	2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+	3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, /* 0xE0 */
+	4, 4, 4, 4, 4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 0xF0 */
+};
+
 void
 eprint(const char *format, ...) {
 	va_list ap;
@@ -137,21 +197,53 @@ eprint(const char *format, ...) {
 
 void end_paragraph(void) {
 	if (in_paragraph) {
-		fputs("</p>\n", stdout);
+		oputs("</p>\n");
 		in_paragraph = 0;
 	}
 }
 
+char *
+balloc(unsigned long size) {
+	char *p;
+
+	if (!scratch)
+		return ereallocz(NULL, size);
+	if (size > scratchsize - scratchused) {
+		if (!err)
+			err = SMU_ESCRATCH;
+		return NULL;
+	}
+	p = scratch + scratchused;
+	scratchused += size;
+	return p;
+}
+
+void
+bfree(char *p) {
+	if (!scratch)
+		free(p);
+	else if (p)
+		scratchused = p - scratch;
+}
+
+void
+charge(const char *begin, const char *end) {
+	work += end - begin;
+	if (limits.work && work > limits.work && !err)
+		err = SMU_EWORK;
+}
+
 int
 docomment(const char *begin, const char *end, int newblock) {
-	char *p;
+	const char *p;
 
 	if (nohtml || strncmp("<!--", begin, 4))
 		return 0;
-	p = strstr(begin, "-->");
+	p = find(begin, "-->");
 	if (!p || p + 3 >= end)
 		return 0;
-	fprintf(stdout, "%.*s\n", (int)(p + 3 - begin), begin);
+	owrite(begin, p + 3 - begin);
+	oputc('\n');
 	return (p + 3 - begin) * (newblock ? -1 : 1);
 }
 
@@ -178,7 +270,7 @@ docodefence(const char *begin, const char *end, int newblock) {
 	p = start - 1;
 	do {
 		stop = p;
-		p = strstr(p + 1, code_fence);
+		p = find(p + 1, code_fence);
 	} while (p && p[-1] == '\\');
 	if (p && p[-1] != '\\')
 		stop = p;
@@ -189,14 +281,14 @@ docodefence(const char *begin, const char *end, int newblock) {
 
 	/* Print output */
 	if (lang_start == lang_stop) {
-		fputs("<pre><code>", stdout);
+		oputs("<pre><code>");
 	} else {
-		fputs("<pre><code class=\"language-", stdout);
+		oputs("<pre><code class=\"language-");
 		hprint(lang_start, lang_stop);
-		fputs("\">", stdout);
+		oputs("\">");
 	}
 	hprint(start, stop);
-	fputs("</code></pre>\n", stdout);
+	oputs("</code></pre>\n");
 	return -(stop - begin + l);
 }
 
@@ -215,17 +307,17 @@ dohtml(const char *begin, const char *end, int newblock) {
 	tagend = p;
 	if (p > end || tag == tagend)
 		return 0;
-	while ((p = strstr(p, "</")) && p < end) {
+	while ((p = find(p, "</")) && p < end) {
 		p += 2;
 		if (strncmp(p, tag, tagend - tag) == 0 && p[tagend - tag] == '>') {
 			p++;
-			fwrite(begin, sizeof(char), p - begin + tagend - tag, stdout);
+			owrite(begin, p - begin + tagend - tag);
 			return p - begin + tagend - tag;
 		}
 	}
-	p = strchr(tagend, '>');
+	p = findany(tagend, ">");
 	if (p) {
-		fwrite(begin, sizeof(char), p - begin + 1, stdout);
+		owrite(begin, p - begin + 1);
 		return p - begin + 1;
 	}
 	else
@@ -235,6 +327,7 @@ dohtml(const char *begin, const char *end, int newblock) {
 int
 dolineprefix(const char *begin, const char *end, int newblock) {
 	unsigned int i, j, l;
+	unsigned long buffersize;
 	char *buffer;
 	const char *p;
 	int consumed_input = 0;
@@ -253,20 +346,21 @@ dolineprefix(const char *begin, const char *end, int newblock) {
 		if (strncmp(lineprefix[i].search, p, l))
 			continue;
 		if (*begin == '\n')
-			fputc('\n', stdout);
+			oputc('\n');
 
 		/* All line prefixes add a block element. These are not allowed
 		 * inside paragraphs, so we must end the paragraph first. */
 		end_paragraph();
 
-		fputs(lineprefix[i].before, stdout);
+		oputs(lineprefix[i].before);
 		if (lineprefix[i].search[l-1] == '\n') {
-			fputc('\n', stdout);
+			oputc('\n');
 			return l - 1 + consumed_input;
 		}
-		if (!(buffer = malloc(BUFSIZ)))
-			eprint("Malloc failed.");
-		buffer[0] = '\0';
+		/* The content can't be longer than the input */
+		buffersize = end - p + 1;
+		if (!(buffer = balloc(buffersize)))
+			return 0;
 
 		/* Collect lines into buffer while they start with the prefix */
 		j = 0;
@@ -287,7 +381,7 @@ dolineprefix(const char *begin, const char *end, int newblock) {
 		}
 
 		/* Skip empty lines in block */
-		while (*(buffer + j - 1) == '\n') {
+		while (j > 0 && *(buffer + j - 1) == '\n') {
 			j--;
 		}
 
@@ -296,8 +390,9 @@ dolineprefix(const char *begin, const char *end, int newblock) {
 			process(buffer, buffer + strlen(buffer), lineprefix[i].process >= 2);
 		else
 			hprint(buffer, buffer + strlen(buffer));
-		puts(lineprefix[i].after);
-		free(buffer);
+		oputs(lineprefix[i].after);
+		oputc('\n');
+		bfree(buffer);
 		return -(p - begin);
 	}
 	return 0;
@@ -316,10 +411,10 @@ dolink(const char *begin, const char *end, int newblock) {
 	else
 		return 0;
 	p = desc = begin + 1 + img;
-	if (!(p = strstr(desc, "](")) || p > end)
+	if (!(p = find(desc, "](")) || p > end)
 		return 0;
-	for (q = strstr(desc, "!["); q && q < end && q < p; q = strstr(q + 1, "!["))
-		if (!(p = strstr(p + 1, "](")) || p > end)
+	for (q = find(desc, "!["); q && q < end && q < p; q = find(q + 1, "!["))
+		if (!(p = find(p + 1, "](")) || p > end)
 			return 0;
 	descend = p;
 	link = p + 2;
@@ -327,7 +422,7 @@ dolink(const char *begin, const char *end, int newblock) {
 	/* find end of link while handling nested parens */
 	q = link;
 	while (parens_depth) {
-		if (!(q = strpbrk(q, "()")) || q > end)
+		if (!(q = findany(q, "()")) || q > end)
 			return 0;
 		if (*q == '(')
 			parens_depth++;
@@ -337,7 +432,7 @@ dolink(const char *begin, const char *end, int newblock) {
 			q++;
 	}
 
-	if ((p = strpbrk(link, "\"'")) && p < end && q > p) {
+	if ((p = findany(link, "\"'")) && p < end && q > p) {
 		sep = p[0]; /* separator: can be " or ' */
 		title = p + 1;
 		/* strip trailing whitespace */
@@ -359,39 +454,40 @@ dolink(const char *begin, const char *end, int newblock) {
 
 	len = q + 1 - begin;
 	if (img) {
-		fputs("<img src=\"", stdout);
+		oputs("<img src=\"");
 		hprint(link, linkend);
-		fputs("\" alt=\"", stdout);
+		oputs("\" alt=\"");
 		hprint(desc, descend);
-		fputs("\" ", stdout);
+		oputs("\" ");
 		if (title && titleend) {
-			fputs("title=\"", stdout);
+			oputs("title=\"");
 			hprint(title, titleend);
-			fputs("\" ", stdout);
+			oputs("\" ");
 		}
-		fputs("/>", stdout);
+		oputs("/>");
 	}
 	else {
-		fputs("<a href=\"", stdout);
+		oputs("<a href=\"");
 		hprint(link, linkend);
-		fputs("\"", stdout);
+		oputs("\"");
 		if (title && titleend) {
-			fputs(" title=\"", stdout);
+			oputs(" title=\"");
 			hprint(title, titleend);
-			fputs("\"", stdout);
+			oputs("\"");
 		}
-		fputs(">", stdout);
+		oputs(">");
 		process(desc, descend, 0);
-		fputs("</a>", stdout);
+		oputs("</a>");
 	}
 	return len;
 }
 
 int
 dolist(const char *begin, const char *end, int newblock) {
-	unsigned int i, j, indent, run, isblock, start_number;
+	unsigned int i, j, indent, run, isblock, start_number = 1;
+	unsigned long buffersize;
 	const char *p, *q, *num_start;
-	char *buffer = NULL;
+	char *buffer;
 	char marker = '\0';  /* Bullet symbol or \0 for unordered lists */
 
 	isblock = 0;
@@ -419,16 +515,19 @@ dolist(const char *begin, const char *end, int newblock) {
 
 	for (p++; p != end && (*p == ' ' || *p == '\t'); p++);
 	indent = p - q;
-	buffer = ereallocz(buffer, BUFSIZ);
+	/* An item is never longer than the input, plus a newline and NUL */
+	buffersize = end - p + 2;
+	if (!(buffer = balloc(buffersize)))
+		return 0;
 	if (!newblock)
-		fputc('\n', stdout);
+		oputc('\n');
 
 	if (marker) {
-		fputs("<ul>\n", stdout);
+		oputs("<ul>\n");
 	} else if (start_number == 1) {
-		fputs("<ol>\n", stdout);
+		oputs("<ol>\n");
 	} else {
-		printf("<ol start=\"%d\">\n", start_number);
+		oprintf("<ol start=\"%d\">\n", start_number);
 	}
 	run = 1;
 	for (; p < end && run; p++) {
@@ -478,12 +577,12 @@ dolist(const char *begin, const char *end, int newblock) {
 			ADDC(buffer, i) = *p;
 		}
 		ADDC(buffer, i) = '\0';
-		fputs("<li>", stdout);
+		oputs("<li>");
 		process(buffer, buffer + i, isblock > 1 || (isblock == 1 && run));
-		fputs("</li>\n", stdout);
+		oputs("</li>\n");
 	}
-	fputs(marker ? "</ul>\n" : "</ol>\n", stdout);
-	free(buffer);
+	oputs(marker ? "</ul>\n" : "</ol>\n");
+	bfree(buffer);
 	p--;
 	while (*(--p) == '\n');
 	return -(p - begin + 1);
@@ -491,9 +590,6 @@ dolist(const char *begin, const char *end, int newblock) {
 
 int
 dotable(const char *begin, const char *end, int newblock) {
-	/* table state */
-	static signed char intable, inrow, incell;
-	static unsigned long int calign;
 	static const char *align_table[] = {
 		"",
 		" style=\"text-align: left\"",
@@ -512,13 +608,13 @@ dotable(const char *begin, const char *end, int newblock) {
 		return p - begin + 1;
 	}
 	if(inrow && (begin + 1 >= end || begin[1] == '\n')) {       /* close cell and row and if ends, table too */
-		fprintf(stdout, "</t%c></tr>", inrow == -1 ? 'h' : 'd');
+		oprintf("</t%c></tr>", inrow == -1 ? 'h' : 'd');
 		if (inrow == -1)
 			intable = 2;
 		inrow = 0;
 		if(end - begin <= 2 || begin[2] == '\n') {
 			intable = 0;
-			fputs("\n</table>\n", stdout);
+			oputs("\n</table>\n");
 		}
 		return 1;
 	}
@@ -540,16 +636,16 @@ dotable(const char *begin, const char *end, int newblock) {
 				}
 			}
 		}
-		fputs("<table>\n<tr>", stdout);
+		oputs("<table>\n<tr>");
 	}
 	if(!inrow) {                                                /* open row */
 		inrow = 1; incell = 0;
-		fputs("<tr>", stdout);
+		oputs("<tr>");
 	}
 	if(incell)                                                  /* close cell */
-		fprintf(stdout, "</t%c>", inrow == -1 ? 'h' : 'd');
+		oprintf("</t%c>", inrow == -1 ? 'h' : 'd');
 	l = incell < l ? (calign >> (incell * 2)) & 3 : 0;          /* open cell */
-	fprintf(stdout, "<t%c%s>", inrow == -1 ? 'h' : 'd', align_table[l]);
+	oprintf("<t%c%s>", inrow == -1 ? 'h' : 'd', align_table[l]);
 	incell++;
 	for(p = begin + 1; p < end && *p == ' '; p++);
 	return p - begin;
@@ -558,17 +654,17 @@ dotable(const char *begin, const char *end, int newblock) {
 int
 doparagraph(const char *begin, const char *end, int newblock) {
 	const char *p;
-	regmatch_t match;
 
 	if (!newblock)
 		return 0;
-	if (regexec(&p_end_regex, begin + 1, 1, &match, 0)) {
-		p = end;
-	} else {
-		p = begin + 1 + match.rm_so;
-	}
+	/* Paragraphs end at an empty line or a code fence */
+	for (p = begin + 1; p < end; p++)
+		if ((*p == '\n' && (p[1] == '\n' || !strncmp(p + 1, code_fence, 3)))
+		|| (p == begin + 1 && !strncmp(p, code_fence, 3)))
+			break;
+	charge(begin, p);
 
-	fputs("<p>", stdout);
+	oputs("<p>");
 	in_paragraph = 1;
 	process(begin, p, 0);
 	end_paragraph();
@@ -585,7 +681,7 @@ doreplace(const char *begin, const char *end, int newblock) {
 		if (end - begin < l)
 			continue;
 		if (strncmp(replace[i][0], begin, l) == 0) {
-			fputs(replace[i][1], stdout);
+			oputs(replace[i][1]);
 			return l;
 		}
 	}
@@ -616,22 +712,22 @@ doshortlink(const char *begin, const char *end, int newblock) {
 		case '>':
 			if (ismail == 0)
 				return 0;
-			fputs("<a href=\"", stdout);
+			oputs("<a href=\"");
 			if (ismail == 1) {
 				/* mailto: */
-				fputs("&#x6D;&#x61;i&#x6C;&#x74;&#x6F;:", stdout);
+				oputs("&#x6D;&#x61;i&#x6C;&#x74;&#x6F;:");
 				for (c = begin + 1; *c != '>'; c++)
-					fprintf(stdout, "&#%u;", *c);
-				fputs("\">", stdout);
+					oprintf("&#%u;", *c);
+				oputs("\">");
 				for (c = begin + 1; *c != '>'; c++)
-					fprintf(stdout, "&#%u;", *c);
+					oprintf("&#%u;", *c);
 			}
 			else {
 				hprint(begin + 1, p);
-				fputs("\">", stdout);
+				oputs("\">");
 				hprint(begin + 1, p);
 			}
-			fputs("</a>", stdout);
+			oputs("</a>");
 			return p - begin + 1;
 		}
 	}
@@ -651,14 +747,14 @@ dosurround(const char *begin, const char *end, int newblock) {
 		p = start;
 		do {
 			stop = p;
-			p = strstr(p + 1, surround[i].search);
+			p = find(p + 1, surround[i].search);
 		} while (p && p[-1] == '\\');
 		if (!p || p[-1] == '\\')  /* No unescaped closing marker found */
 			continue;
 		stop = p;
 		if (!stop || stop < start || stop >= end)
 			continue;
-		fputs(surround[i].before, stdout);
+		oputs(surround[i].before);
 
 		/* Single space at start and end are ignored */
 		if (start[0] == ' ' && stop[-1] == ' ' && start < stop - 1) {
@@ -671,7 +767,7 @@ dosurround(const char *begin, const char *end, int newblock) {
 			process(start, stop, 0);
 		else
 			hprint(start, stop);
-		fputs(surround[i].after, stdout);
+		oputs(surround[i].after);
 		return stop - start + 2 * l;
 	}
 	return 0;
@@ -692,12 +788,12 @@ dounderline(const char *begin, const char *end, int newblock) {
 	for (i = 0; i < LENGTH(underline); i++) {
 		for (j = 0; p + j < end && p[j] != '\n' && p[j] == underline[i].search[0]; j++);
 		if (j >= 3) {
-			fputs(underline[i].before, stdout);
+			oputs(underline[i].before);
 			if (underline[i].process)
 				process(begin, begin + l, 0);
 			else
 				hprint(begin, begin + l);
-			fputs(underline[i].after, stdout);
+			oputs(underline[i].after);
 			return -(j + p - begin);
 		}
 	}
@@ -713,94 +809,498 @@ ereallocz(void *p, size_t size) {
 	return res;
 }
 
+int
+convert(const char *begin, const char *end, int suppresshtml) {
+	nohtml = suppresshtml;
+	docbegin = begin;
+	docend = end;
+	if (map)
+		map->len = map->out = map->in = 0;
+	in_paragraph = intable = inrow = incell = 0;
+	outlen = work = depth = 0;
+	err = SMU_OK;
+	process(begin, end, 1);
+	return err;
+}
+
+const char *
+find(const char *s, const char *needle) {
+	const char *p = strstr(s, needle);
+
+	charge(s, p ? p : s + strlen(s));
+	return p;
+}
+
+const char *
+findany(const char *s, const char *accept) {
+	const char *p = strpbrk(s, accept);
+
+	charge(s, p ? p : s + strlen(s));
+	return p;
+}
+
 void
 hprint(const char *begin, const char *end) {
 	const char *p;
 
 	for (p = begin; p != end; p++) {
 		if (*p == '&')
-			fputs("&amp;", stdout);
+			oputs("&amp;");
 		else if (*p == '"')
-			fputs("&quot;", stdout);
+			oputs("&quot;");
 		else if (*p == '>')
-			fputs("&gt;", stdout);
+			oputs("&gt;");
 		else if (*p == '<')
-			fputs("&lt;", stdout);
+			oputs("&lt;");
 		else
-			fputc(*p, stdout);
+			oputc(*p);
 	}
 }
 
 void
 process(const char *begin, const char *end, int newblock) {
 	const char *p;
-	int affected;
+	int affected, mapped;
 	unsigned int i;
+	unsigned long mlen = 0, mout = 0, min = 0;
 
-	for (p = begin; p < end;) {
+	/* depth counts the elements around begin, the document is not one */
+	if (limits.depth && depth > limits.depth) {
+		if (!err)
+			err = SMU_EDEPTH;
+		return;
+	}
+	depth++;
+	for (p = begin; p < end && !err;) {
 		if (newblock)
 			while (*p == '\n')
 				if (++p == end)
-					return;
-
-		for (i = 0; i < LENGTH(parsers); i++)
+					break;
+		if (p == end)
+			break;
+		charge(p, p + 1);
+
+		/* Content of nested blocks is a copy, which can't be mapped.
+		 * The entry goes before those of nested elements, and is
+		 * dropped again when no parser matches. */
+		mapped = map && ((newblock && depth == 1) || map->inlines)
+		         && p >= docbegin && p < docend;
+		if (mapped) {
+			mlen = map->len;
+			mout = map->out;
+			min = map->in;
+			mapadd(outlen, p - docbegin);
+		}
+		affected = 0;
+		for (i = 0; i < LENGTH(parsers) && !err; i++)
 			if ((affected = parsers[i](p, end, newblock)))
 				break;
+		if (mapped && !affected) {
+			map->len = mlen;
+			map->out = mout;
+			map->in = min;
+		}
 		if (affected)
 			p += abs(affected);
 		else
-			fputc(*p++, stdout);
+			oputc(*p++);
 
 		/* Don't print single newline at end */
 		if (p + 1 == end && *p == '\n')
-			return;
+			break;
 
 		if (p[0] == '\n' && p + 1 != end && p[1] == '\n')
 			newblock = 1;
 		else
 			newblock = affected < 0;
 	}
+	depth--;
+}
+
+void
+mapadd(unsigned long o, unsigned long i) {
+	unsigned long v[2];
+	unsigned int k;
+
+	/* Output offset delta, then input offset delta in zigzag encoding,
+	 * both as little endian base 128 varints */
+	v[0] = o - map->out;
+	v[1] = i >= map->in ? (i - map->in) << 1 : ((map->in - i) << 1) - 1;
+	map->out = o;
+	map->in = i;
+	if (map->size - map->len < 2 * (sizeof(unsigned long) * 8 / 7 + 1)) {
+		map->size = 2 * map->size + BUFSIZ;
+		map->data = ereallocz(map->data, map->size);
+	}
+	for (k = 0; k < 2; k++) {
+		do {
+			map->data[map->len] = v[k] & 0x7f;
+			v[k] >>= 7;
+			map->data[map->len++] |= v[k] ? 0x80 : 0;
+		} while (v[k]);
+	}
+}
+
+void
+oprintf(const char *format, ...) {
+	va_list ap;
+	char buf[64];
+
+	va_start(ap, format);
+	owrite(buf, vsprintf(buf, format, ap));
+	va_end(ap);
+}
+
+void
+oputc(int c) {
+	if (err)
+		return;
+	if (limits.output && outlen >= limits.output) {
+		err = SMU_EOUTPUT;
+		return;
+	}
+	if (out)
+		putc(c, out);
+	else if (outlen < outsize)
+		outbuf[outlen] = c;
+	outlen++;
+}
+
+void
+oputs(const char *s) {
+	owrite(s, strlen(s));
+}
+
+void
+owrite(const char *s, unsigned long len) {
+	if (err)
+		return;
+	if (limits.output && outlen + len > limits.output) {
+		err = SMU_EOUTPUT;
+		return;
+	}
+	if (out)
+		fwrite(s, 1, len, out);
+	else if (outlen < outsize)
+		memcpy(outbuf + outlen, s, len < outsize - outlen ? len : outsize - outlen);
+	outlen += len;
 }
 
+#ifdef __SSE2__
+/* Validates the 16 bytes at p, which must start a character, and returns how
+ * many of them are complete characters, or 0 if they are not valid. */
+unsigned int
+utf8block(const unsigned char *p) {
+	__m128i b, cont, lead2, lead3, lead4, prev, bad;
+
+	b = _mm_loadu_si128((const __m128i *)p);
+	/* Continuation bytes are below -64 as signed bytes, leading bytes of
+	 * longer sequences are at least 0xC0, 0xE0 or 0xF0 */
+	cont = _mm_cmplt_epi8(b, _mm_set1_epi8(-64));
+	lead2 = _mm_cmpeq_epi8(_mm_max_epu8(b, _mm_set1_epi8((char)0xC0)), b);
+	lead3 = _mm_cmpeq_epi8(_mm_max_epu8(b, _mm_set1_epi8((char)0xE0)), b);
+	lead4 = _mm_cmpeq_epi8(_mm_max_epu8(b, _mm_set1_epi8((char)0xF0)), b);
+
+	/* Exactly the bytes following a leading byte are continuations */
+	bad = _mm_xor_si128(cont, _mm_or_si128(_mm_slli_si128(lead2, 1),
+	      _mm_or_si128(_mm_slli_si128(lead3, 2), _mm_slli_si128(lead4, 3))));
+	/* NUL, overlong 0xC0 and 0xC1, and 0xF5 to 0xFF */
+	bad = _mm_or_si128(bad, _mm_cmpeq_epi8(b, _mm_setzero_si128()));
+	bad = _mm_or_si128(bad, _mm_cmpeq_epi8(_mm_and_si128(b, _mm_set1_epi8((char)0xFE)),
+	                                       _mm_set1_epi8((char)0xC0)));
+	bad = _mm_or_si128(bad, _mm_cmpeq_epi8(_mm_max_epu8(b, _mm_set1_epi8((char)0xF5)), b));
+	/* Second byte ranges exclude overlongs, surrogates and code points
+	 * above U+10FFFF */
+	prev = _mm_slli_si128(b, 1);
+	bad = _mm_or_si128(bad, _mm_and_si128(_mm_cmpeq_epi8(prev, _mm_set1_epi8((char)0xE0)),
+	                                      _mm_cmplt_epi8(b, _mm_set1_epi8((char)0xA0))));
+	bad = _mm_or_si128(bad, _mm_and_si128(_mm_cmpeq_epi8(prev, _mm_set1_epi8((char)0xED)),
+	                                      _mm_cmpgt_epi8(b, _mm_set1_epi8((char)0x9F))));
+	bad = _mm_or_si128(bad, _mm_and_si128(_mm_cmpeq_epi8(prev, _mm_set1_epi8((char)0xF0)),
+	                                      _mm_cmplt_epi8(b, _mm_set1_epi8((char)0x90))));
+	bad = _mm_or_si128(bad, _mm_and_si128(_mm_cmpeq_epi8(prev, _mm_set1_epi8((char)0xF4)),
+	                                      _mm_cmpgt_epi8(b, _mm_set1_epi8((char)0x8F))));
+	if (_mm_movemask_epi8(bad))
+		return 0;
+
+	/* Leave a character running past the block to the next one */
+	if (_mm_movemask_epi8(lead2) & 0x8000)
+		return 15;
+	if (_mm_movemask_epi8(lead3) & 0x4000)
+		return 14;
+	if (_mm_movemask_epi8(lead4) & 0x2000)
+		return 13;
+	return 16;
+}
+#endif
+
 int
-main(int argc, char *argv[]) {
+smu_convert(FILE *outfile, FILE *in, int suppresshtml) {
 	char *buffer = NULL;
-	int s, i;
-	unsigned long len, bsize;
-	FILE *source = stdin;
-
-	regcomp(&p_end_regex, "(\n\n|(^|\n)```)", REG_EXTENDED);
-
-	for (i = 1; i < argc; i++) {
-		if (!strcmp("-v", argv[i]))
-			eprint("simple markup %s (C) Enno Boland\n",VERSION);
-		else if (!strcmp("-n", argv[i]))
-			nohtml = 1;
-		else if (argv[i][0] != '-')
-			break;
-		else if (!strcmp("--", argv[i])) {
-			i++;
-			break;
+	unsigned long len = 0, bsize = 0, s;
+	int res;
+
+	do {
+		if (limits.input && len > limits.input) {
+			free(buffer);
+			return SMU_EINPUT;
 		}
-		else
-			eprint("Usage %s [-n] [file]\n -n escape html strictly\n", argv[0]);
-	}
-	if (i < argc && !(source = fopen(argv[i], "r")))
-		eprint("Cannot open file `%s`\n",argv[i]);
-	bsize = 2 * BUFSIZ;
-	buffer = ereallocz(buffer, bsize);
-	len = 0;
-	while ((s = fread(buffer + len, 1, BUFSIZ, source))) {
-		len += s;
-		if (BUFSIZ + len + 1 > bsize) {
-			bsize += BUFSIZ;
-			if (!(buffer = realloc(buffer, bsize)))
-				eprint("realloc failed.");
+		if (len + BUFSIZ + 1 > bsize) {
+			bsize = 2 * bsize + BUFSIZ + 1;
+			buffer = ereallocz(buffer, bsize);
 		}
-	}
+		len += s = fread(buffer + len, 1, BUFSIZ, in);
+	} while (s);
 	buffer[len] = '\0';
-	process(buffer, buffer + len, 1);
-	fclose(source);
+	res = smu_convertstr(outfile, buffer, len, suppresshtml);
 	free(buffer);
-	return EXIT_SUCCESS;
+	return res;
+}
+
+int
+smu_convertbuf(char *outb, unsigned long size, unsigned long *written,
+               const char *in, unsigned long len,
+               char *scratchb, unsigned long scratchbsize, int suppresshtml) {
+	char *copy;
+	int res;
+
+	if (limits.input && len > limits.input)
+		return SMU_EINPUT;
+	if (!scratchb)
+		return SMU_ESCRATCH;
+	out = NULL;
+	outbuf = outb;
+	outsize = size;
+	scratch = scratchb;
+	scratchsize = scratchbsize;
+	scratchused = 0;
+
+	/* The parsers rely on a NUL after the input */
+	err = SMU_OK;
+	if (!(copy = balloc(len + 1)))
+		res = err;
+	else {
+		memcpy(copy, in, len);
+		copy[len] = '\0';
+		res = convert(copy, copy + len, suppresshtml);
+		bfree(copy);
+	}
+	*written = outlen;
+	scratch = NULL;
+	if (!res && outlen > size)
+		res = SMU_ESPACE;
+	return res;
+}
+
+int
+smu_convertsection(FILE *outfile, const char *in, unsigned long len,
+                   const SmuHeading *heading, int suppresshtml) {
+	if (heading->begin > heading->end || heading->end > len)
+		return SMU_EINPUT;
+	return smu_convertstr(outfile, in + heading->begin, heading->end - heading->begin, suppresshtml);
+}
+
+int
+smu_convertstr(FILE *outfile, const char *in, unsigned long len, int suppresshtml) {
+	if (limits.input && len > limits.input)
+		return SMU_EINPUT;
+	out = outfile;
+	return convert(in, in + len, suppresshtml);
+}
+
+unsigned long
+smu_index(const char *in, unsigned long len, SmuHeading *headings, unsigned long n) {
+	const char *p, *q, *next, *end = in + len;
+	unsigned long count = 0, open[6];
+	unsigned int nopen = 0, j;
+	int level, newblock = 1;
+	SmuHeading h;
+
+	for (p = in; p < end; p = next) {
+		if ((next = memchr(p, '\n', end - p)))
+			next++;
+		else
+			next = end;
+		level = 0;
+		if ((next - p >= 3 && !strncmp(p, code_fence, 3))
+		|| ((p - in <= 1 || p[-2] == '\n') && next - p >= 4 && !strncmp(p + 1, code_fence, 3))) {
+			/* Fences open at the start of a line or after the first
+			 * character of a block, see doparagraph. As in docodefence
+			 * they close at the next unescaped ``` after that line. */
+			for (q = next; q + 3 <= end && (strncmp(q, code_fence, 3) || q[-1] == '\\'); q++);
+			if (q + 3 > end || !(next = memchr(q, '\n', end - q)))
+				next = end;
+			else
+				next++;
+			newblock = 1;
+			continue;
+		} else if (newblock && next - p >= 4 && !strncmp(p, "<!--", 4)) {
+			/* Comments are copied as they are if they are closed before
+			 * the end, see docomment */
+			for (q = p + 2; q + 3 < end && strncmp(q, "-->", 3); q++);
+			if (q + 3 < end) {
+				if ((next = memchr(q, '\n', end - q)))
+					next++;
+				else
+					next = end;
+				continue;
+			}
+		}
+		if (*p == '#') {
+			/* ATX headings as in lineprefix */
+			for (q = p; q < next && *q == '#'; q++);
+			if (q - p <= 6 && q < next && *q == ' ') {
+				level = q - p;
+				h.title = q + 1 - in;
+				h.titleend = next - in - (next[-1] == '\n');
+			}
+		} else if (newblock && *p != '\n' && next < end) {
+			/* Underlined headings as in dounderline */
+			for (j = 0; j < LENGTH(underline); j++) {
+				for (q = next; q < end && *q == underline[j].search[0]; q++);
+				if (q - next >= 3) {
+					level = j + 1;
+					h.title = p - in;
+					h.titleend = next - 1 - in;
+					if ((next = memchr(q, '\n', end - q)))
+						next++;
+					else
+						next = end;
+					break;
+				}
+			}
+		}
+		/* Paragraph lines continue a block, everything else ends it */
+		newblock = level || strchr("\n \t>|-*+", *p) || isdigit((unsigned char)*p);
+		if (!level)
+			continue;
+
+		/* A heading ends all open sections of the same or lower level */
+		h.begin = p - in;
+		h.level = level;
+		for (; nopen && headings[open[nopen - 1]].level >= level; nopen--)
+			headings[open[nopen - 1]].end = h.begin;
+		if (count < n) {
+			h.end = len;
+			headings[count] = h;
+			open[nopen++] = count;
+		}
+		count++;
+	}
+	return count;
 }
+
+int
+smu_mapnext(const SmuMap *m, unsigned long *pos, unsigned long *o, unsigned long *i) {
+	unsigned long v[2];
+	unsigned int k, shift;
+
+	if (*pos >= m->len)
+		return 0;
+	for (k = 0; k < 2; k++) {
+		v[k] = 0;
+		shift = 0;
+		do {
+			v[k] |= (unsigned long)(m->data[*pos] & 0x7f) << shift;
+			shift += 7;
+		} while (m->data[(*pos)++] & 0x80 && *pos < m->len);
+	}
+	*o += v[0];
+	if (v[1] & 1)
+		*i -= (v[1] + 1) >> 1;
+	else
+		*i += v[1] >> 1;
+	return 1;
+}
+
+void
+smu_setmap(SmuMap *m) {
+	map = m;
+}
+
+void
+smu_setlimits(const SmuLimits *l) {
+	if (l)
+		limits = *l;
+	else
+		memset(&limits, 0, sizeof(limits));
+}
+
+const char *
+smu_strerror(int e) {
+	if (e < 0 || e >= LENGTH(errors))
+		return "Unknown error";
+	return errors[e];
+}
+
+char *
+smu_utf8fix(const char *buffer, unsigned long *len, unsigned long valid) {
+	char *res = NULL;
+	const char *p, *end;
+	unsigned long i, n;
+
+	/* Every invalid byte becomes U+FFFD, which takes three bytes */
+	res = ereallocz(res, 3 * *len + 1);
+	memcpy(res, buffer, valid);
+	i = valid;
+	end = buffer + *len;
+	for (p = buffer + valid; p < end;) {
+		if ((n = smu_utf8span(p, end))) {
+			memcpy(res + i, p, n);
+			i += n;
+			p += n;
+			continue;
+		}
+		if (*p != '\0') {
+			memcpy(res + i, "\xEF\xBF\xBD", 3);
+			i += 3;
+		}
+		p++;
+	}
+	res[i] = '\0';
+	*len = i;
+	return res;
+}
+
+unsigned long
+smu_utf8span(const char *begin, const char *end) {
+	const unsigned char *p = (const unsigned char *)begin;
+	const unsigned char *e = (const unsigned char *)end;
+	const unsigned long lo = ~0UL / 255, hi = lo * 128;
+	unsigned long w;
+	unsigned int i, n;
+	unsigned char min, max;
+
+	while (p < e) {
+#ifdef __SSE2__
+		if (e - p >= 16 && (n = utf8block(p))) {
+			p += n;
+			continue;
+		}
+#endif
+		/* Fast path: a whole word of ASCII without NUL bytes */
+		if ((unsigned long)(e - p) >= sizeof(w)) {
+			memcpy(&w, p, sizeof(w));
+			if (!((w | ((w - lo) & ~w)) & hi)) {
+				p += sizeof(w);
+				continue;
+			}
+		}
+		if (!(n = utf8len[*p]) || e - p < n)
+			break;
+		if (n > 1) {
+			/* Second byte ranges exclude overlongs, surrogates and
+			 * code points above U+10FFFF */
+			min = *p == 0xE0 ? 0xA0 : *p == 0xF0 ? 0x90 : 0x80;
+			max = *p == 0xED ? 0x9F : *p == 0xF4 ? 0x8F : 0xBF;
+			if (p[1] < min || p[1] > max)
+				break;
+			for (i = 2; i < n && (p[i] & 0xC0) == 0x80; i++);
+			if (i < n)
+				break;
+		}
+		p += n;
+	}
+	return (const char *)p - begin;
+}
+
@@ -5,15 +5,143 @@
  */
 #include <stdio.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* errors returned by the conversion functions */
+enum {
+	SMU_OK,
+	SMU_EINPUT,   /* input is larger than limits.input */
+	SMU_EOUTPUT,  /* output would get larger than limits.output */
+	SMU_EDEPTH,   /* elements are nested deeper than limits.depth */
+	SMU_EWORK,    /* parsers examined more than limits.work bytes */
+	SMU_ESPACE,   /* output buffer is too small */
+	SMU_ESCRATCH  /* scratch buffer is too small */
+};
+
+/* Per conversion resource limits, 0 means unlimited. */
+typedef struct {
+	unsigned long input, output, depth, work;
+} SmuLimits;
+
+/* A heading and the section it starts, as byte offsets into the input. */
+typedef struct {
+	unsigned long begin, end;       /* section including the heading */
+	unsigned long title, titleend;  /* text of the heading */
+	int level;
+} SmuHeading;
+
+/*
+ * Source map from output to input offsets. Each entry holds the output
+ * offset minus the one of the previous entry and the same difference of the
+ * input offsets in zigzag encoding, 2d for d >= 0 and -2d - 1 for d < 0. Both
+ * are stored as little endian base 128 varints, 7 bits per byte with the high
+ * bit set on all but the last byte. The first entry is relative to 0, 0.
+ */
+typedef struct {
+	unsigned char *data;   /* entries, allocated by smu */
+	unsigned long len, size;
+	unsigned long out, in; /* offsets of the last entry */
+	int inlines;           /* also map inline elements, not only blocks */
+} SmuMap;
+
 /**
  * Converts contents of a simple markup stream (in) and prints them to out.
  * If suppresshtml == 1, it will create plain text of the simple markup instead
  * of HTML.
  *
- * Returns 0 on success.
+ * Returns 0 on success or one of the errors above when a limit is hit. The
+ * conversion stops there, so out contains a prefix of the result.
  */
 int smu_convert(FILE *out, FILE *in, int suppresshtml);
 
+/**
+ * Like smu_convert, but converts the len bytes at in, which must be followed
+ * by a NUL byte.
+ */
+int smu_convertstr(FILE *out, const char *in, unsigned long len, int suppresshtml);
+
+/**
+ * Like smu_convertstr, but writes the output to the size bytes at out and
+ * never allocates memory. in does not need to be NUL terminated.
+ *
+ * The input and the content of nested blocks are copied to the scratchsize
+ * bytes at scratch, and SMU_ESCRATCH is returned if scratch is NULL. With a
+ * depth limit of d, (d + 2) * (len + 2) bytes of scratch always suffice. Most
+ * documents need little more than len + 1. The stack use is bounded by d as
+ * well, each level of nesting takes less than 256 bytes on amd64. Without a
+ * depth limit, SMU_ESCRATCH is returned once the scratch is exhausted.
+ *
+ * Returns 0 and stores the length of the output in written. If the output
+ * does not fit, SMU_ESPACE is returned and the full length of the output is
+ * stored in written, so written - size more bytes are needed. The output is
+ * not NUL terminated.
+ */
+int smu_convertbuf(char *out, unsigned long size, unsigned long *written,
+                   const char *in, unsigned long len,
+                   char *scratch, unsigned long scratchsize, int suppresshtml);
+
+/**
+ * Finds the headings in the len bytes at in without converting them and
+ * stores the first n in headings. A section ends at the next heading of the
+ * same or a higher level. Returns the number of headings in the input.
+ *
+ * Headings are found line by line, so ones in nested blocks like lists and
+ * blockquotes are not indexed.
+ */
+unsigned long smu_index(const char *in, unsigned long len, SmuHeading *headings, unsigned long n);
+
+/**
+ * Converts only the section of heading, as found by smu_index in the len
+ * bytes at in, which must be followed by a NUL byte. The rest of the input is
+ * skipped.
+ */
+int smu_convertsection(FILE *out, const char *in, unsigned long len,
+                       const SmuHeading *heading, int suppresshtml);
+
+/**
+ * Sets the limits for all following conversions. NULL removes all limits.
+ */
+void smu_setlimits(const SmuLimits *limits);
+
+/**
+ * Makes the following conversions record a source map in map, replacing its
+ * entries each time. Start with a zeroed SmuMap and free data when done.
+ * Top level blocks are mapped, and with inlines set all elements outside of
+ * lists and blockquotes are. Elements come before the ones nested in them, so
+ * the output offsets never decrease. NULL stops recording. Recording allocates
+ * memory, even in smu_convertbuf.
+ */
+void smu_setmap(SmuMap *map);
+
+/**
+ * Decodes the entry of map at byte pos and advances pos past it. out and in
+ * hold the offsets of the previous entry, and are set to the ones of this
+ * entry. Start with all three at 0. Returns 0 at the end of the map.
+ */
+int smu_mapnext(const SmuMap *map, unsigned long *pos, unsigned long *out, unsigned long *in);
+
+/** Returns a description of an error returned by the conversion functions. */
+const char *smu_strerror(int err);
+
+/**
+ * Returns the number of bytes from begin that are valid UTF-8. NUL bytes are
+ * treated as invalid, since they would end the conversion.
+ */
+unsigned long smu_utf8span(const char *begin, const char *end);
+
+/**
+ * Returns a newly allocated copy of the len bytes at in with every invalid
+ * byte after the first valid ones replaced by U+FFFD and NULs stripped. The
+ * new length is stored in len.
+ */
+char *smu_utf8fix(const char *in, unsigned long *len, unsigned long valid);
+
 /** utility */
 void eprint(const char *format, ...);
+void *ereallocz(void *p, size_t size);
 
+#ifdef __cplusplus
+}
+#endif
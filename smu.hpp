@@ -0,0 +1,128 @@
+/* libsmu - C++ interface
+ *
+ * See LICENSE for further informations
+ */
+#ifndef SMU_HPP
+#define SMU_HPP
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+
+#include "smu.h"
+
+namespace smu {
+
+/**
+ * Converts documents with smu_convertbuf, keeping the scratch and output
+ * buffers between conversions so that converting many documents does not
+ * allocate once they have grown large enough.
+ *
+ * smu keeps the state of a conversion in globals, so only one conversion may
+ * run at a time in a process, no matter how many converters exist.
+ *
+ * All functions return 0 or one of the SMU_E* errors of smu.h.
+ */
+class Converter {
+public:
+	explicit Converter(bool suppresshtml = false, const SmuLimits &limits = SmuLimits())
+		: suppresshtml_(suppresshtml), limits_(limits) {}
+
+	Converter(Converter &&) noexcept = default;
+	Converter &operator=(Converter &&) noexcept = default;
+	Converter(const Converter &) = delete;
+	Converter &operator=(const Converter &) = delete;
+
+	/** Appends the HTML for in to out, leaving out unchanged on errors. */
+	int convert(std::string_view in, std::string &out) {
+		std::size_t base = out.size();
+		unsigned long written;
+		int res;
+
+		/* Guess the size, and convert again if that was too small */
+		out.resize(base + guess(in.size()));
+		for (;;) {
+			res = convertbuf(in, &out[base], out.size() - base, &written);
+			if (res != SMU_ESPACE)
+				break;
+			out.resize(base + written);
+		}
+		out.resize(res ? base : base + written);
+		return res;
+	}
+
+	/**
+	 * Calls sink with a std::string_view of the HTML for in. The view
+	 * points into the converter and is valid until the next conversion.
+	 */
+	template <class Sink>
+	int convert(std::string_view in, Sink &&sink) {
+		unsigned long written;
+		int res;
+
+		if (buffer_.size() < guess(in.size()))
+			buffer_.resize(guess(in.size()));
+		while ((res = convertbuf(in, buffer_.data(), buffer_.size(), &written)) == SMU_ESPACE)
+			buffer_.resize(written);
+		if (!res)
+			sink(std::string_view(buffer_.data(), written));
+		return res;
+	}
+
+	/** Appends the HTML for each of the documents to out. */
+	template <class It>
+	int convert(It first, It last, std::string &out) {
+		int res;
+
+		for (; first != last; ++first)
+			if ((res = convert(std::string_view(*first), out)))
+				return res;
+		return 0;
+	}
+
+#if __cplusplus >= 202002L
+	int convert(std::span<const std::string_view> docs, std::string &out) {
+		return convert(docs.begin(), docs.end(), out);
+	}
+
+	int convert(std::span<const std::string> docs, std::string &out) {
+		return convert(docs.begin(), docs.end(), out);
+	}
+#endif
+
+private:
+	/* Outputs so far took up to growth_ sixteenths of their input more */
+	std::size_t guess(std::size_t len) const {
+		return len + len * growth_ / 16 + 64;
+	}
+
+	int convertbuf(std::string_view in, char *out, std::size_t size, unsigned long *written) {
+		int res;
+
+		smu_setlimits(&limits_);
+		/* Start with room for the copy of the input and some nesting */
+		if (scratch_.size() < 2 * (in.size() + 2))
+			scratch_.resize(2 * (in.size() + 2));
+		while ((res = smu_convertbuf(out, size, written, in.data(), in.size(),
+		                             scratch_.data(), scratch_.size(), suppresshtml_)) == SMU_ESCRATCH)
+			scratch_.resize(2 * scratch_.size());
+		/* Learn how much larger the output gets, to convert only once */
+		if ((!res || res == SMU_ESPACE) && *written > guess(in.size()))
+			growth_ = ((*written - in.size() - 64) * 16 + in.size() - 1) / in.size();
+		return res;
+	}
+
+	bool suppresshtml_;
+	std::size_t growth_ = 4;
+	SmuLimits limits_;
+	std::vector<char> scratch_;
+	std::vector<char> buffer_;
+};
+
+} /* namespace smu */
+
+#endif
@@ -0,0 +1,65 @@
+/* Prints the entries of a source map written by smu -m or -M, each with the
+ * start of the output and input it maps, and fails unless the output offsets
+ * are in order.
+ *
+ * Usage: mapcheck mapfile htmlfile textfile
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "smu.h"
+
+static char *readfile(const char *path, unsigned long *len);
+static void show(const char *s, unsigned long len, unsigned long off);  /* Prints the start of s at off */
+
+char *
+readfile(const char *path, unsigned long *len) {
+	FILE *f;
+	char *buf = NULL;
+	unsigned long size = 0;
+
+	if (!(f = fopen(path, "rb")))
+		eprint("Cannot open file `%s`\n", path);
+	for (*len = 0; !feof(f);) {
+		if (*len == size)
+			buf = ereallocz(buf, size = 2 * size + BUFSIZ);
+		*len += fread(buf + *len, 1, size - *len, f);
+	}
+	fclose(f);
+	return buf;
+}
+
+void
+show(const char *s, unsigned long len, unsigned long off) {
+	unsigned long i;
+
+	putchar(' ');
+	for (i = off; i < len && i < off + 12; i++)
+		if (s[i] == '\n')
+			fputs("\\n", stdout);
+		else
+			putchar(s[i]);
+}
+
+int
+main(int argc, char *argv[]) {
+	SmuMap map = { 0 };
+	unsigned long pos = 0, o = 0, i = 0, prev = 0, hlen, tlen;
+	char *html, *text;
+
+	if (argc != 4)
+		eprint("Usage %s mapfile htmlfile textfile\n", argv[0]);
+	map.data = (unsigned char *)readfile(argv[1], &map.len);
+	html = readfile(argv[2], &hlen);
+	text = readfile(argv[3], &tlen);
+	while (smu_mapnext(&map, &pos, &o, &i)) {
+		if (o < prev || o > hlen || i > tlen)
+			eprint("Entry %lu %lu out of order or range\n", o, i);
+		printf("%lu %lu", o, i);
+		show(html, hlen, o);
+		show(text, tlen, i);
+		putchar('\n');
+		prev = o;
+	}
+	return 0;
+}